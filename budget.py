@@ -0,0 +1,76 @@
+#!/usr/bin/env python3
+"""Check the firmware's flash, SRAM and per-symbol sizes against limits.
+
+The limits file has one "name bytes" pair per line, # starts a comment.
+A name is a symbol in the elf file, "flash" (.text + .data), "sram"
+(.data + .bss + .noinit) or "*", the limit for every symbol that is not
+listed. Prints each size that is over its limit and exits with 1 if
+there are any.
+
+Usage: ./budget.py budget.txt driver.elf
+The avr-nm and avr-size tools can be overridden with NM and SIZE.
+"""
+import os
+import subprocess
+import sys
+
+NM = os.environ.get("NM", "avr-nm")
+SIZE = os.environ.get("SIZE", "avr-size")
+
+
+def read_limits(path):
+    limits = {}
+    for line in open(path):
+        fields = line.split("#")[0].split()
+        if fields:
+            limits[fields[0]] = int(fields[1], 0)
+    return limits
+
+
+def symbols(elf):
+    out = subprocess.check_output([NM, "-S", "--size-sort", elf], text=True)
+    sizes = {}
+    for line in out.splitlines():
+        fields = line.split()
+        if len(fields) == 4:
+            _, size, _, name = fields
+            sizes[name] = sizes.get(name, 0) + int(size, 16)
+    return sizes
+
+
+def sections(elf):
+    out = subprocess.check_output([SIZE, "-A", elf], text=True)
+    sizes = {}
+    for line in out.splitlines():
+        fields = line.split()
+        if len(fields) == 3 and fields[0].startswith("."):
+            sizes[fields[0]] = int(fields[1])
+    return sizes
+
+
+def main():
+    limits = read_limits(sys.argv[1])
+    elf = sys.argv[2]
+    sec = sections(elf)
+    sizes = {
+        "flash": sec.get(".text", 0) + sec.get(".data", 0),
+        "sram": sec.get(".data", 0) + sec.get(".bss", 0)
+                + sec.get(".noinit", 0),
+    }
+    for name, size in symbols(elf).items():
+        sizes[name] = size
+
+    over = 0
+    default = limits.get("*")
+    for name, size in sorted(sizes.items()):
+        limit = limits.get(name, default)
+        if limit is not None and size > limit:
+            print("%s: %d bytes, limit %d" % (name, size, limit))
+            over += 1
+    print("flash %d/%s, sram %d/%s" % (sizes["flash"], limits.get("flash"),
+                                       sizes["sram"], limits.get("sram")))
+    sys.exit(1 if over else 0)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,181 @@
+#!/usr/bin/env python3
+"""Run the firmware through fixed power cycle sequences and check the
+output levels.
+
+Each runner prints the level trace of hal_host.c: "on <ms> ms, boot <n>",
+"off <ms> ms" and "<time> ms <level>" whenever the output changes. The
+runner is a command line the on/off times are appended to, so the same
+checks work on the host build and on the real image in simavr:
+
+Usage: ./check.py [-m | -l] runner...
+  ./check.py ./driver_host
+  ./check.py -m ./driver_host_mem
+  ./check.py -l "./driver_host_batt -b 125"
+  ./check.py "./driver_sim build/driver.hex"
+  ./check.py -m "./driver_sim build/driver_mem.hex"
+
+-m adds the checks for a MODE_MEMORY build. -l runs only the low cell
+checks, for a BATT_MONITOR build with the cell between BATT_CRIT and
+BATT_LOW. Prints one line per check and exits with 1 if any failed.
+"""
+import shlex
+import subprocess
+import sys
+
+MODES = [255, 64, 16, 4] # steady levels of boots 1 to 4, see mode_table
+RAMP_MS = (2700, 3200) # bottom to top of the ramp, 99 steps of RAMP_DELAY
+STROBE_MS = 112 # strobe period, 7 watchdog ticks of 16 ms
+VAR_STROBE = [20, 40, 20, 70, 20, 100, 20, 130, 20, 100, 20, 70] # ms
+
+failed = 0
+
+
+def run(runner, times):
+    """Power cycle the firmware, return one list of (ms, level) per boot."""
+    cmd = shlex.split(runner) + [str(t) for t in times]
+    out = subprocess.run(cmd, stdout=subprocess.PIPE, check=True,
+                         universal_newlines=True).stdout
+    boots = []
+    for line in out.splitlines():
+        f = line.split()
+        if f[0] == "on":
+            boots.append([])
+        elif len(f) == 3 and f[1] == "ms":
+            boots[-1].append((float(f[0]), int(f[2])))
+    if len(boots) != (len(times) + 1) // 2:
+        raise RuntimeError("%s: expected %d boots, got %d"
+                           % (runner, (len(times) + 1) // 2, len(boots)))
+    return boots
+
+
+def final(boot):
+    return boot[-1][1] if boot else 0
+
+
+def first_at(boot, level):
+    for t, lvl in boot:
+        if lvl == level:
+            return t
+    return None
+
+
+def check(name, ok, detail):
+    global failed
+    print("%s %s: %s" % ("pass" if ok else "FAIL", name, detail))
+    if not ok:
+        failed += 1
+
+
+def check_modes(runner):
+    b = run(runner, [1000, 100, 1000, 100, 1000, 100, 1000, 100, 3500, 100,
+                     1000])
+    got = [final(b[i]) for i in range(4)]
+    check("mode sequence", got == MODES, "levels %s" % got)
+
+    ramp = b[4]
+    top = first_at(ramp, 255)
+    check("ramp timing", top is not None and RAMP_MS[0] <= top <= RAMP_MS[1],
+          "255 after %s ms" % top)
+    levels = [lvl for t, lvl in ramp if top is None or t <= top]
+    check("ramp rises", levels == sorted(levels) and len(set(levels)) > 50,
+          "%d steps" % len(set(levels)))
+    check("ramp select", final(b[5]) == final(ramp),
+          "ramp stopped at %d, selected %d" % (final(ramp), final(b[5])))
+
+
+def check_ramp_top(runner, memory):
+    """Resume the ramp at its top level, by short presses from ramp select
+    or with mode memory from EEPROM after a long off."""
+    t = [1000, 100, 1000, 100, 1000, 100, 1000, 100, 4000]
+    top = first_at(run(runner, t)[4], 255)
+    # off in the middle of the two ramp steps spent at the top, wherever
+    # the PWM period puts them
+    t[-1] = round(top or 3000) + 30
+    t += [100, 300, 100, 300, 100, 300, 100, 300, 100, 300, 100]
+    t += [300, 1000, 2000] if memory else [2000]
+    b = run(runner, t)
+    steps = len(set(lvl for _, lvl in b[-1]))
+    check("ramp from the top", final(b[4]) == 255 and steps > 20,
+          "%d steps after a ramp stopped at %d" % (steps, final(b[4])))
+
+
+def check_strobe(runner):
+    b = run(runner, [20, 100, 20, 100, 20, 100, 1000])
+    edges = [t for (t, lvl), (_, prev) in zip(b[3][1:], b[3])
+             if lvl == 255 and prev == 0]
+    periods = [b - a for a, b in zip(edges, edges[1:])]
+    ok = len(edges) >= 5 and all(abs(p - STROBE_MS) <= STROBE_MS / 10
+                                 for p in periods)
+    check("strobe entry", ok, "%d flashes, periods %s ms"
+          % (len(edges), sorted(set(round(p) for p in periods))))
+    # three more taps to the variable strobe, timed by Timer0 to within a
+    # PWM period (under 1 ms). Builds with a longer PWM period play it
+    # from the watchdog, rounded to 16 ms ticks.
+    b = run(runner, [20, 100] * 6 + [3000])
+    steps = [t1 - t0 for (t0, _), (t1, _) in zip(b[6], b[6][1:])]
+    err = max([abs(s - w) for s, w in zip(steps, VAR_STROBE * 10)] or [99])
+    ticks = [(ms + 8) // 16 * 16 for ms in VAR_STROBE]
+    wdt = max([abs(s - w) / w for s, w in zip(steps, ticks * 10)] or [1])
+    check("variable strobe", len(steps) > 30 and (err <= 1 or wdt <= 0.1),
+          "%d steps, %.2f ms off at most%s" % (len(steps), err,
+          "" if err <= 1 else ", watchdog timed"))
+    # just past SHORT_PRESS_MS each press is a mode change, not a tap
+    b = run(runner, [30, 100, 30, 100, 30, 100, 1000])
+    check("no strobe after 30 ms presses",
+          final(b[3]) == MODES[3] and 255 not in [lvl for _, lvl in b[3]],
+          "boot 4 at %s" % sorted(set(lvl for _, lvl in b[3])))
+
+
+def check_memory(runner):
+    b = run(runner, [1000, 100, 1000, 1000, 1000])
+    check("mode memory", final(b[2]) == MODES[1],
+          "restored %d after a long off" % final(b[2]))
+    # taps into strobe must not be remembered, only modes kept past the
+    # short-press window
+    b = run(runner, [1000, 100, 1000, 1000, 20, 100, 20, 100, 20, 100, 1000,
+                     1000, 1000])
+    check("mode memory after taps", final(b[-1]) == MODES[1],
+          "restored %d after strobe" % final(b[-1]))
+
+
+def check_low_cell(runner):
+    """The monitor steps down through stepdown_LVL every BATT_SAMPLES slow
+    watchdog periods, to moonlight after 3 steps; strobe follows it."""
+    b = run(runner, [8000])
+    check("low cell steady", final(b[0]) == MODES[3],
+          "high ends at %d" % final(b[0]))
+    b = run(runner, [20, 100, 20, 100, 20, 100, 8000])
+    late = [lvl for t, lvl in b[3] if t > 7000]
+    check("low cell strobe", late and max(late) == MODES[3],
+          "flashes at %s after 7 s" % sorted(set(late)))
+    # the first step needs BATT_SAMPLES slow periods in strobe too, not
+    # BATT_SAMPLES strobe ticks
+    b = run(runner, [20, 100, 20, 100, 20, 100, 1500])
+    early = [lvl for t, lvl in b[3] if lvl]
+    check("low cell strobe sampling", early and min(early) == 255,
+          "flashes at %s in the first 1.5 s" % sorted(set(early)))
+
+
+def main():
+    args = sys.argv[1:]
+    memory = "-m" in args
+    low = "-l" in args
+    runners = [a for a in args if a not in ("-m", "-l")]
+    if not runners:
+        print(__doc__.strip())
+        return 2
+    for runner in runners:
+        print(runner)
+        if low:
+            check_low_cell(runner)
+            continue
+        check_modes(runner)
+        check_ramp_top(runner, memory)
+        check_strobe(runner)
+        if memory:
+            check_memory(runner)
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
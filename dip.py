@@ -0,0 +1,95 @@
+#!/usr/bin/env python3
+"""Simulate the supply dip when the light turns on, with and without the
+soft-start fade.
+
+The runners print the level trace of hal_host.c (see check.py); the first
+is the normal build, the second one built with -DSOFT_START_MS=0. Each is
+powered on once, straight into high, and its output level drives the load
+of a simple supply model:
+
+    cell (V_CELL, R_CELL) -- L_WIRE -- driver input, C_IN -- load
+
+The load is the PWM waveform: I_MAX for level / 255 of each period at the
+PWM frequency, nothing for the rest. Every pulse of the fade draws the
+full current, so the fade lowers the dip only as far as its short pulses
+let C_IN carry them. This is a model for comparing the two builds, not a
+measurement: the spring, switch and wires (L_WIRE) against the driver's
+input capacitance (C_IN) make the supply ring below the static drop when
+the current steps. The static drop is I_MAX * R_CELL either way.
+
+Usage: ./dip.py [-f hz] runner runner_without_fade
+-f is the PWM frequency of the builds, 9412 Hz (phase correct, prescale
+1) by default. Prints the lowest input voltage of each and exits with 1
+unless the fade gives the smaller dip.
+"""
+import shlex
+import subprocess
+import sys
+
+V_CELL = 3.4 # V, a weak cell
+R_CELL = 0.2 # ohm, cell and contacts
+L_WIRE = 10e-6 # H
+C_IN = 100e-6 # F
+I_MAX = 2.8 # A, eight AMC7135 at full output
+PWM_HZ = 4800000 / 510 # phase correct PWM at 4.8 MHz, prescale 1
+DT = 0.1e-6 # s, 0.1% of a PWM period
+ON_MS = 20
+
+
+def levels(runner):
+    """(seconds, level) changes of the first boot."""
+    cmd = shlex.split(runner) + [str(ON_MS)]
+    out = subprocess.run(cmd, stdout=subprocess.PIPE, check=True,
+                         universal_newlines=True).stdout
+    trace = []
+    for line in out.splitlines():
+        f = line.split()
+        if len(f) == 3 and f[1] == "ms":
+            trace.append((float(f[0]) / 1000, int(f[2])))
+    return trace
+
+
+def lowest(trace, pwm_hz):
+    """Lowest driver input voltage over the on time."""
+    i_wire = 0.0
+    v_in = V_CELL
+    v_min = V_CELL
+    k = 0
+    level = 0
+    period = round(1 / pwm_hz / DT) # steps
+    for n in range(int(ON_MS / 1000 / DT)):
+        t = n * DT
+        while k < len(trace) and trace[k][0] <= t:
+            level = trace[k][1]
+            k += 1
+        # the pulse at the start of each period
+        load = I_MAX if n % period * 255 < level * period else 0.0
+        i_wire += (V_CELL - R_CELL * i_wire - v_in) / L_WIRE * DT
+        v_in += (i_wire - load) / C_IN * DT
+        v_min = min(v_min, v_in)
+    return v_min
+
+
+def main():
+    args = sys.argv[1:]
+    pwm_hz = PWM_HZ
+    if args[:1] == ["-f"] and len(args) > 1:
+        pwm_hz = float(args[1])
+        args = args[2:]
+    if len(args) != 2:
+        print(__doc__.strip())
+        return 2
+    static = V_CELL - I_MAX * R_CELL
+    fade = lowest(levels(args[0]), pwm_hz)
+    step = lowest(levels(args[1]), pwm_hz)
+    print("static  %.3f V" % static)
+    print("fade    %.3f V, %.0f mV below static" % (fade, (static - fade) * 1000))
+    print("step    %.3f V, %.0f mV below static" % (step, (static - step) * 1000))
+    ok = fade > step
+    print("%s soft start dip: %.0f mV less" % ("pass" if ok else "FAIL",
+                                               (fade - step) * 1000))
+    return 0 if ok else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -48,51 +48,238 @@
  */
 
 #define F_CPU 4800000
-#include <avr/io.h>
-#include <stdlib.h>
-#include <util/delay.h>
-#include <avr/eeprom.h>
-#include <avr/pgmspace.h>
+#include "hal.h"
 
 //#define MODE_MEMORY
 
 #ifdef MODE_MEMORY // only using eeprom if mode memory is enabled
 uint8_t EEMEM MODE_P;
-uint8_t EEMEM LVL_P;
+uint8_t EEMEM LVL_P; // ramp profile index of the selected level
+#endif
+
+/* Store in uninitialized memory so it will not be overwritten and
+ * can still be read at startup after short (<500ms) power off.
+ * The whole block is covered by a CRC-8 (polynomial 0x07). Any bit that
+ * decayed during power off makes the check fail, and init and xorout are
+ * chosen so that an all-zero or all-one block does not pass either. A
+ * random block still passes with a chance of about 1 in 2^16 (CRC and
+ * decay flag). Whatever changes a field must call noinit_seal() after.
+ */
+typedef struct {
+    uint8_t decay; // 0 while the block is valid
+    uint8_t mode;
+    // profile index and direction of the ramping function, so the ramp
+    // resumes where it was and ramp selection uses the selected level
+    uint8_t ramp_i;
+    uint8_t ramp_down;
+    // number of times light was on for a short period, used to enter
+    // extended modes
+    uint8_t shorts;
+    // extended mode enable, 0 if in regular mode group
+    uint8_t strobe;
+    // extended mode
+    uint8_t strobe_mode;
+    // turbo was stepped down, a short press restores it
+    uint8_t stepdown;
+    uint8_t crc; // must be last
+} __attribute__ ((packed)) noinit_state;
+
+volatile noinit_state noinit NOINIT;
+
+#define NOINIT_CRC_INIT 0xFF
+#define NOINIT_CRC_XOR 0x55
+
+// CRC-8 of the noinit block, without the crc field itself. Not static,
+// driver_host -d calls it, see hal_host.c.
+uint8_t noinit_crc()
+{
+    uint8_t const volatile *p = (uint8_t const volatile *)&noinit;
+    uint8_t crc = NOINIT_CRC_INIT;
+    uint8_t n, b;
+    for (n = 0; n < sizeof(noinit_state) - 1; ++n)
+    {
+        crc ^= p[n];
+        for (b = 0; b < 8; ++b)
+        {
+            crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+        }
+    }
+    return crc ^ NOINIT_CRC_XOR;
+}
+
+static void noinit_seal()
+{
+    noinit.crc = noinit_crc();
+}
+
+/* PWM configuration.
+ * PWM_MODE selects phase correct or fast PWM and PWM_PRESCALE the Timer0
+ * clock division (1, 8, 64 or 256). PWM frequency at 4.8MHz:
+ *
+ *   prescale   phase correct   fast
+ *   1          9.41 kHz        18.75 kHz
+ *   8          1.18 kHz        2.34 kHz
+ *   64         147 Hz          293 Hz
+ *   256        36.8 Hz         73.2 Hz
+ *
+ * Switching losses in the driver grow with the PWM frequency, so lower
+ * is more efficient until flicker becomes visible (a few hundred Hz when
+ * the light is moving). Fast PWM at prescale 1 is above the audible
+ * range, which can stop coil whine on some drivers. Fast PWM's glitch at
+ * 0 duty does not matter here, since 0 is driven as a static output.
+ * At 64 and 256 a period (6.8 and 27ms) is longer than the soft-start
+ * fade, which then holds the bottom level for one period and steps to
+ * the mode level. 1024 is not supported: its 109ms period is longer than
+ * the short-press window.
+ */
+#define PWM_PHASE 0
+#define PWM_FAST 1
+#ifndef PWM_MODE
+#define PWM_MODE PWM_PHASE
+#endif
+#ifndef PWM_PRESCALE
+#define PWM_PRESCALE 1
 #endif
 
-// store in uninitialized memory so it will not be overwritten and
-// can still be read at startup after short (<500ms) power off
-// decay used to tell if user did a short press.
-volatile uint8_t noinit_decay __attribute__ ((section (".noinit")));
-volatile uint8_t noinit_mode __attribute__ ((section (".noinit")));
-// pwm level selected by ramping function
-volatile uint8_t noinit_lvl __attribute__ ((section (".noinit")));
-// number of times light was on for a short period, used to enter
-// extended modes
-volatile uint8_t noinit_short __attribute__ ((section (".noinit")));
-// extended mode enable, 0 if in regular mode group
-volatile uint8_t noinit_strobe __attribute__ ((section (".noinit")));
-// extended mode
-volatile uint8_t noinit_strobe_mode __attribute__ ((section (".noinit")));
-
-// PWM configuration
 #define PWM_PIN PB1
 #define PWM_LVL OCR0B
-#define PWM_TCR 0x21
+
+// Timer0 overflows once per PWM period. In phase correct mode the
+// counter runs up to 0xFF and back down, so a period is 510 timer clocks.
+#if PWM_MODE == PWM_FAST
+#define PWM_WGM (_BV(WGM01) | _BV(WGM00))
+#define PWM_PERIOD 256
+#else
+#define PWM_WGM _BV(WGM00)
+#define PWM_PERIOD 510
+#endif
+#define PWM_TCR (_BV(COM0B1) | PWM_WGM)
+
+#if PWM_PRESCALE == 1
 #define PWM_SCL 0x01
+#elif PWM_PRESCALE == 8
+#define PWM_SCL 0x02
+#elif PWM_PRESCALE == 64
+#define PWM_SCL 0x03
+#elif PWM_PRESCALE == 256
+#define PWM_SCL 0x04
+#else
+#error "unsupported PWM_PRESCALE"
+#endif
+
+#define PWM_TICK_HZ (F_CPU / PWM_PRESCALE / PWM_PERIOD)
+
+/* Clock scaling.
+ * Lower the system clock once a mode is set, and lower Timer0's
+ * prescaler by the same factor so the PWM frequency does not change.
+ * This needs PWM_PRESCALE to be 8 or more.
+ */
+//#define CLOCK_SCALING
 
-// This will be the same as the PWM_PIN on a stock driver
-#define STROBE_PIN PB1
+#ifdef CLOCK_SCALING
+#if PWM_PRESCALE == 8 // clk/8 becomes clk/1
+#define CLOCK_DIV clock_div_8
+#define PWM_SCL_SCALED 0x01
+#elif PWM_PRESCALE == 64 // clk/64 becomes clk/8
+#define CLOCK_DIV clock_div_8
+#define PWM_SCL_SCALED 0x02
+#elif PWM_PRESCALE == 256 // clk/256 becomes clk/64
+#define CLOCK_DIV clock_div_4
+#define PWM_SCL_SCALED 0x03
+#else
+#error "CLOCK_SCALING needs PWM_PRESCALE of 8 or more"
+#endif
+#endif
+
+/* Power gating configuration.
+ * Blocks the firmware does not use are switched off at boot. Set one to
+ * 0 (e.g. make DEFS=-DGATE_ADC=0) to leave that block powered, e.g. to
+ * measure its share of the supply current.
+ */
+// analog comparator, powered after reset
+#ifndef GATE_ACOMP
+#define GATE_ACOMP 1
+#endif
+// ADC, off after reset but its clock can be gated on the ATtiny13A
+#ifndef GATE_ADC
+#define GATE_ADC 1
+#endif
+// digital input buffers, no pin is read as a digital input
+#ifndef GATE_DIDR
+#define GATE_DIDR 1
+#endif
+#define DIDR_PINS (_BV(ADC0D) | _BV(ADC2D) | _BV(ADC3D) | _BV(ADC1D) \
+                   | _BV(AIN1D) | _BV(AIN0D))
+
+// on time in ms below which a power cycle counts as a short press,
+// three short presses in a row enter the strobe modes
+#ifndef SHORT_PRESS_MS
+#define SHORT_PRESS_MS 25
+#endif
+
+/* Strobe configuration.
+ * Strobe patterns are played from the watchdog interrupt, and the MCU is
+ * in power-down sleep between edges. The watchdog runs from its own
+ * 128kHz oscillator, so these times are only accurate to about 10%.
+ * Patterns marked PATTERN_TIMER are timed by Timer0 instead, to the
+ * system clock's accuracy, and the MCU stays in idle sleep. That needs a
+ * PWM period below 1ms (PWM_PRESCALE 1 or 8), otherwise they play from
+ * the watchdog too.
+ */
+#if PWM_PRESCALE * PWM_PERIOD < F_CPU / 1000 // PWM period below 1ms
+#define TIMER_DELAY // see timer_delay()
+#endif
+
+#define WDT_TICK_MS 16 // shortest watchdog period
+#define WDT_TICKS(ms) (((ms) + WDT_TICK_MS / 2) / WDT_TICK_MS)
+
+// watchdog period for background tasks in steady modes
+#define WDT_SLOW (_BV(WDP2) | _BV(WDP0))
+#define WDT_SLOW_MS 500
+
+// beacon flash and time between flashes in ms
+#define BEACON_ON 30
+#define BEACON_OFF 2000
+
+// SOS dot length in ms, dashes are three dots
+#define SOS_DOT 200
+
+/* Battery monitor configuration.
+ * With BATT_MONITOR defined the cell voltage is sampled by the ADC every
+ * slow watchdog period. After BATT_SAMPLES low readings in a row the output
+ * steps down to the next level in stepdown_LVL, and below BATT_CRIT the
+ * light turns off. Values are ADCH readings with the 1.1V reference on
+ * the stock nanjg divider (19.1k/4.7k on PB2).
+ */
+//#define BATT_MONITOR
+#define BATT_CHANNEL 1 // ADC1, PB2
+#define BATT_LOW 130 // about 3.0V
+#define BATT_CRIT 120 // about 2.8V
+#define BATT_SAMPLES 4 // one sample every WDT_SLOW_MS
+
+/* Turbo step-down configuration.
+ * With TURBO_TIMEOUT defined, mode 0 steps down to TURBO_STEPDOWN after
+ * that many seconds. A short press after the step-down restores turbo
+ * instead of moving to the next mode.
+ */
+//#define TURBO_TIMEOUT 60
+#define TURBO_STEPDOWN 0x40
 
 /* Ramping configuration.
- * Configure the LUT used for the ramping function and the delay between
- * steps of the ramp.
+ * Configure the profile used for the ramping function and the delay
+ * between steps of the ramp.
  */
 
 // delay in ms between each ramp step
 #define RAMP_DELAY 30
 
+// Fade in to the mode level over about this many ms by walking the profile,
+// to limit the inrush current that sags weak cells and can trip the
+// brown-out reset. Set to 0 to switch modes instantly.
+#ifndef SOFT_START_MS
+#define SOFT_START_MS 4
+#endif
+
 #define SINUSOID 4, 4, 5, 6, 8, 10, 13, 16, 20, 24, 28, 33, 39, 44, 50, 57, 63, 70, 77, 85, 92, 100, 108, 116, 124, 131, 139, 147, 155, 163, 171, 178, 185, 192, 199, 206, 212, 218, 223, 228, 233, 237, 241, 244, 247, 250, 252, 253, 254, 255
 // natural log of a sinusoid
 #define LN_SINUSOID 5, 5, 5, 5, 5, 5, 5, 5, 5, 6, 6, 6, 6, 6, 7, 7, 8, 8, 9, 10, 11, 12, 14, 16, 18, 21, 24, 27, 32, 37, 43, 50, 58, 67, 77, 88, 101, 114, 128, 143, 158, 174, 189, 203, 216, 228, 239, 246, 252, 255
@@ -103,200 +290,980 @@ volatile uint8_t noinit_strobe_mode __attribute__ ((section (".noinit")));
 // smooth sinusoidal ramping
 #define SIN_SQUARED 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 6, 6, 6, 6, 7, 7, 7, 8, 8, 9, 10, 11, 11, 12, 14, 15, 16, 17, 19, 21, 22, 24, 26, 29, 31, 33, 36, 39, 42, 45, 48, 51, 54, 58, 62, 66, 69, 74, 78, 82, 87, 91, 96, 100, 105, 110, 115, 120, 125, 130, 135, 140, 146, 151, 156, 161, 166, 171, 176, 181, 186, 191, 195, 200, 204, 209, 213, 217, 221, 224, 228, 231, 234, 237, 240, 243, 245, 247, 249, 251, 252, 253, 254, 254, 255, 255
 
+/* Packed ramp profiles, generated by lut_pack.py from the lists above.
+ * Each profile is its first level and number of levels, then the
+ * differences between levels packed two per byte, high nibble first. A
+ * nibble of 0xF adds 15 and continues with the next nibble. All profiles
+ * together take less flash than two unpacked ones.
+ */
+#define PACKED_SINUSOID 0x04, 0x32, 0x01, 0x12, 0x23, 0x34, 0x44, 0x56, 0x56, 0x76, 0x77, 0x87, 0x88, 0x88, 0x78, 0x88, 0x88, 0x77, 0x77, 0x76, 0x65, 0x55, 0x44, 0x33, 0x32, 0x11, 0x10
+#define PROFILE_SINUSOID 0
+#define PACKED_LN_SINUSOID 0x05, 0x32, 0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x01, 0x01, 0x01, 0x11, 0x12, 0x22, 0x33, 0x35, 0x56, 0x78, 0x9A, 0xBD, 0xDE, 0xF0, 0xF0, 0xF1, 0xF0, 0xED, 0xCB, 0x76, 0x30
+#define PROFILE_LN_SINUSOID 27
+#define PACKED_SQUARED 0x04, 0x33, 0x00, 0x11, 0x11, 0x11, 0x22, 0x22, 0x33, 0x33, 0x34, 0x34, 0x45, 0x45, 0x55, 0x56, 0x56, 0x67, 0x67, 0x77, 0x78, 0x88, 0x88, 0x98, 0x99, 0xA9, 0xAA
+#define PROFILE_SQUARED 56
+#define PACKED_SIN_SQUARED_4 0x04, 0x5D, 0x00, 0x00, 0x00, 0x10, 0x00, 0x10, 0x01, 0x01, 0x11, 0x01, 0x21, 0x11, 0x22, 0x12, 0x23, 0x22, 0x33, 0x33, 0x33, 0x43, 0x44, 0x44, 0x44, 0x54, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x65, 0x55, 0x55, 0x54, 0x55, 0x45, 0x44, 0x43, 0x43, 0x33, 0x33, 0x22, 0x21, 0x21, 0x10, 0x10
+#define PROFILE_SIN_SQUARED_4 83
+#define PACKED_SIN_SQUARED 0x05, 0x64, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x01, 0x00, 0x10, 0x11, 0x10, 0x12, 0x11, 0x12, 0x21, 0x22, 0x32, 0x23, 0x33, 0x33, 0x33, 0x44, 0x43, 0x54, 0x45, 0x45, 0x45, 0x55, 0x55, 0x55, 0x56, 0x55, 0x55, 0x55, 0x55, 0x54, 0x54, 0x54, 0x44, 0x34, 0x33, 0x33, 0x32, 0x22, 0x21, 0x11, 0x01, 0x00
+#define PROFILE_SIN_SQUARED 131
+
+/* Compute the SIN_SQUARED profile on the fly instead of storing the
+ * profiles in flash. Saves the profile tables and their decoder, and
+ * costs a few hundred cycles per ramp step. RAMP_PROFILE is ignored.
+ */
+//#define RAMP_GENERATOR
+
+#ifndef RAMP_GENERATOR
+// store in program memory. It would use too much SRAM. lut_p is an 8 bit
+// offset, so it must stay below 256 bytes.
+uint8_t const ramp_profiles[] PROGMEM = {
+    PACKED_SINUSOID, PACKED_LN_SINUSOID, PACKED_SQUARED,
+    PACKED_SIN_SQUARED_4, PACKED_SIN_SQUARED
+};
+#endif
+#define RAMP_MAX_LEN 100 // levels in the longest profile
+
 // select which ramping profile to use.
-// store in program memory. It would use too much SRAM.
-uint8_t const ramp_LUT[] PROGMEM = { SIN_SQUARED };
+#define RAMP_PROFILE PROFILE_SIN_SQUARED
 
+/* Strobe patterns, played by the extended modes.
+ * Each step is an output level and a time in watchdog periods, or in ms
+ * for a pattern played from Timer0 (TON and TOFF, up to 255ms). A time
+ * of 0 ends the pattern, which then repeats from the start.
+ */
+#define ON(ms) 0xFF, WDT_TICKS(ms)
+#define OFF(ms) 0x00, WDT_TICKS(ms)
+#define TON(ms) 0xFF, (ms)
+#define TOFF(ms) 0x00, (ms)
+#define END 0x00, 0
+#define SOS_S ON(SOS_DOT), OFF(SOS_DOT), ON(SOS_DOT), OFF(SOS_DOT), ON(SOS_DOT)
+#define SOS_O ON(3 * SOS_DOT), OFF(SOS_DOT), ON(3 * SOS_DOT), OFF(SOS_DOT), \
+              ON(3 * SOS_DOT)
 
-/* Rise-Fall Ramping brightness selection /\/\/\/\
- * cycle through PWM values from ramp_LUT (look up table). Traverse LUT
- * forwards, then backwards. Current PWM value is saved in noinit_lvl so
- * it is available at next startup (after a short press).
-*/
-void ramp()
+#define STROBE ON(20), OFF(90), END
+#define BEACON ON(BEACON_ON), OFF(BEACON_OFF), END
+#define SOS SOS_S, OFF(3 * SOS_DOT), SOS_O, OFF(3 * SOS_DOT), SOS_S, \
+            OFF(7 * SOS_DOT), END
+// strobe that slows down and speeds up again, timed by Timer0 where it
+// can be since WDT_TICKS would round its steps by up to 8ms
+#ifdef TIMER_DELAY
+#define VON TON
+#define VOFF TOFF
+#define VAR_STROBE_TIMER PATTERN_TIMER
+#else
+#define VON ON
+#define VOFF OFF
+#define VAR_STROBE_TIMER 0
+#endif
+#define VAR_STROBE VON(20), VOFF(40), VON(20), VOFF(70), VON(20), VOFF(100), \
+                   VON(20), VOFF(130), VON(20), VOFF(100), VON(20), VOFF(70), \
+                   END
+
+uint8_t const pattern_data[] PROGMEM = { STROBE, BEACON, SOS, VAR_STROBE };
+
+// start of each pattern in pattern_data, in extended mode order, with
+// PATTERN_TIMER set if its times are in ms. pattern_data must stay
+// below 128 bytes.
+#define PATTERN_TIMER 0x80
+#define STROBE_AT 0
+#define BEACON_AT (STROBE_AT + sizeof((uint8_t[]){ STROBE }))
+#define SOS_AT (BEACON_AT + sizeof((uint8_t[]){ BEACON }))
+#define VAR_STROBE_AT (SOS_AT + sizeof((uint8_t[]){ SOS }))
+uint8_t const pattern_start[] PROGMEM = {
+    STROBE_AT, BEACON_AT, SOS_AT, VAR_STROBE_AT | VAR_STROBE_TIMER
+};
+
+// number of extended (strobe) modes
+#define STROBE_MODES sizeof(pattern_start)
+
+/* Main modes, in the order a short press steps through them. Each entry
+ * is a kind and a parameter:
+ *   MODE_STEADY    fixed output level
+ *   MODE_RAMP      ramp up and down through a profile, param is a
+ *                  PROFILE_* offset
+ *   MODE_RAMP_SEL  hold the level the ramp was left at, param is the
+ *                  profile it is looked up in
+ *   MODE_STROBE    play a strobe pattern, param is its index in
+ *                  pattern_start
+ * Adding, removing or reordering modes only touches this table.
+ */
+#define MODE_STEADY 0
+#define MODE_RAMP 1
+#define MODE_RAMP_SEL 2
+#define MODE_STROBE 3
+
+typedef struct {
+    uint8_t kind;
+    uint8_t param;
+} mode_entry;
+
+mode_entry const mode_table[] PROGMEM = {
+    { MODE_STEADY, 0xFF }, // high
+    { MODE_STEADY, 0x40 }, // medium
+    { MODE_STEADY, 0x10 }, // low
+    { MODE_STEADY, 0x04 }, // moonlight
+    { MODE_RAMP, RAMP_PROFILE },
+    { MODE_RAMP_SEL, RAMP_PROFILE },
+};
+
+#define MODES (sizeof(mode_table) / sizeof(mode_table[0]))
+
+#ifdef CLOCK_SCALING
+static uint8_t pwm_scl = PWM_SCL; // Timer0 prescaler for the current clock
+#else
+#define pwm_scl PWM_SCL
+#endif
+
+#ifdef BATT_MONITOR
+static volatile uint8_t lvl_max = 0xFF; // output ceiling set by the monitor
+#endif
+
+// sleep mode to use once a mode is set, see set_level()
+static volatile uint8_t steady_sleep = SLEEP_MODE_IDLE;
+
+// PWM periods left in the short-press window, see TIM0_COMPA_vect
+#define SHORT_TICKS ((uint16_t)((uint32_t)PWM_TICK_HZ * SHORT_PRESS_MS / 1000 + 1))
+static volatile uint16_t short_ticks;
+
+// ms left in timer_delay(), 0 when no delay is running (always without
+// TIMER_DELAY). Not static, driver_host -t reads it, see hal_host.c.
+volatile uint16_t timer_ms;
+
+// Lower the system clock, see clock scaling configuration. Timer0 keeps
+// running at PWM_TICK_HZ, as its prescaler is lowered by the same factor.
+static inline void clock_scale()
+{
+    #ifdef CLOCK_SCALING
+    clock_prescale_set(CLOCK_DIV);
+    if (TCCR0B) // only if PWM is running
+    {
+        TCCR0B = PWM_SCL_SCALED;
+    }
+    pwm_scl = PWM_SCL_SCALED;
+    #endif
+}
+
+
+// Switch off unused peripherals, see power gating configuration
+static inline void power_gate()
+{
+    #if GATE_ACOMP
+    ACSR = _BV(ACD);
+    #endif
+    #if GATE_ADC && defined(PRR) && !defined(BATT_MONITOR)
+    PRR = _BV(PRADC);
+    #endif
+    #if GATE_DIDR
+    DIDR0 = DIDR_PINS;
+    #endif
+}
+
+// Sleep forever in steady_sleep mode, waking only to service
+// interrupts.
+static void __attribute__ ((noreturn)) sleep_loop()
 {
-    uint8_t i = 0;
+    uint8_t mode;
     while (1){
-        for (i = 0; i < sizeof(ramp_LUT); i++){
-            PWM_LVL = pgm_read_byte(&(ramp_LUT[i]));
-            noinit_lvl = PWM_LVL; // remember after short power off
-            _delay_ms(RAMP_DELAY); //gives a period of x seconds
+        cli();
+        mode = steady_sleep;
+        #ifdef BATT_MONITOR
+        // the ADC stops in power-down, let a conversion finish first
+        if (ADCSRA & _BV(ADSC))
+        {
+            mode = SLEEP_MODE_IDLE;
         }
-        for (i = sizeof(ramp_LUT) - 1; i > 0; i--){
-            PWM_LVL = pgm_read_byte(&(ramp_LUT[i]));
-            noinit_lvl = PWM_LVL; // remember after short power off
-            _delay_ms(RAMP_DELAY); //gives a period of x seconds
+        #endif
+        #ifdef MODE_MEMORY
+        // an EEPROM write keeps the clock running in power-down anyway,
+        // and EE_RDY_vect must be able to wake us
+        if (EECR & _BV(EERIE))
+        {
+            mode = SLEEP_MODE_IDLE;
         }
+        #endif
+        set_sleep_mode(mode);
+        sleep_enable();
+        sei(); // the next instruction runs before any interrupt
+        sleep_cpu();
+        sleep_disable();
+    }
+}
+
+/* Set the output level in PWM mode, 0 and 0xFF included. The ramp
+ * engine uses this as it needs Timer0 running to take its next step.
+ */
+static void set_pwm(uint8_t lvl)
+{
+    PWM_LVL = lvl;
+    TCCR0A = PWM_TCR;
+    TCCR0B = pwm_scl;
+    steady_sleep = SLEEP_MODE_IDLE;
+}
 
+/* Set the output level. Fully off and fully on do not need PWM, so for
+ * 0 and 0xFF OC0B is disconnected, PWM_PIN is driven as a plain output
+ * and Timer0 is stopped once the short-press window has closed. This
+ * avoids switching losses and lets the MCU use power-down sleep instead
+ * of idle.
+ */
+static void set_level(uint8_t lvl)
+{
+    if (lvl == 0 || lvl == 0xFF)
+    {
+        PWM_LVL = lvl;
+        if (lvl)
+        {
+            PORTB |= _BV(PWM_PIN);
+        }
+        else
+        {
+            PORTB &= ~_BV(PWM_PIN);
+        }
+        TCCR0A = PWM_WGM; // pin disconnected from the timer
+        if (short_ticks || timer_ms) // timer still times a window or delay
+        {
+            TCCR0B = pwm_scl;
+            steady_sleep = SLEEP_MODE_IDLE;
+        }
+        else
+        {
+            TCCR0B = 0; // stop the timer
+            steady_sleep = SLEEP_MODE_PWR_DOWN;
+        }
+    }
+    else
+    {
+        set_pwm(lvl);
     }
 }
 
-/* Rising Ramping brightness selection //////
- * Cycle through PWM values from ramp_LUT (look up table). Current PWM
- * value is saved in noinit_lvl so it is available at next startup
- * (after a short press)
-*/
-void ramp2()
+#ifdef MODE_MEMORY
+/* EEPROM writes. ee_save() only marks LVL_P and MODE_P, EE_RDY_vect
+ * writes them from noinit once the EEPROM is ready so the light path
+ * never waits for a write cycle. Bytes that are already stored are not
+ * rewritten. Taking the values from noinit instead of a queue saves the
+ * RAM, see budget.txt.
+ */
+static volatile uint8_t ee_len; // bytes left, 2 LVL_P, 1 MODE_P
+
+ISR(EE_RDY_vect)
 {
-    uint8_t i = 0;
-    while (1){
-        for (i = 0; i < sizeof(ramp_LUT); i++){
-            PWM_LVL = pgm_read_byte(&(ramp_LUT[i]));
-            noinit_lvl = PWM_LVL; // remember after short power off
-            _delay_ms(RAMP_DELAY); //gives a period of x seconds
+    uint8_t *addr;
+    uint8_t val;
+
+    while (ee_len){
+        addr = &MODE_P;
+        val = noinit.mode;
+        if (--ee_len)
+        {
+            addr = &LVL_P;
+            val = noinit.ramp_i;
+        }
+        EEARL = (uint8_t)(uintptr_t)addr;
+        EECR |= _BV(EERE);
+        if (EEDR != val) // only write changed bytes
+        {
+            EEDR = val;
+            EECR |= _BV(EEMPE);
+            EECR |= _BV(EEPE); // within 4 cycles of EEMPE
+            return;
         }
+    }
+    EECR &= ~_BV(EERIE); // queue empty and last write done
+}
 
-        //_delay_ms(1000);
+// Save the mode and level, called with interrupts off
+static void ee_save()
+{
+    ee_len = 2;
+    EECR |= _BV(EERIE);
+}
+#endif
+
+// Timer0 compare A matches once per PWM period
+ISR(TIM0_COMPA_vect)
+{
+    if (short_ticks && !--short_ticks)
+    {
+        noinit.shorts = 0; // on for too long, reset short press counter
+        noinit_seal();
+        #ifdef MODE_MEMORY // kept past a short press, remember it
+        ee_save(); // mode and level, each skipped if unchanged
+        #endif
+        TIMSK0 &= ~_BV(OCIE0A); // window closed, stop waking every period
+        if (!(TCCR0A & _BV(COM0B1)) && !timer_ms) // timer not needed
+        {
+            TCCR0B = 0;
+            steady_sleep = SLEEP_MODE_PWR_DOWN;
+        }
     }
 }
 
-// strobe just by changing pwm, can use this with normal pwm pin setup
-static void inline pwm_strobe()
+// Start the watchdog in interrupt mode with the given prescaler bits
+static void wdt_start(uint8_t wdp)
 {
-    while (1){
-        PWM_LVL = 255;
-        _delay_ms(20);
-        PWM_LVL = 0;
-        _delay_ms(90);
+    uint8_t sreg = SREG;
+    cli();
+    wdt_reset();
+    WDTCR = _BV(WDCE) | _BV(WDE); // timed sequence to change prescaler
+    WDTCR = _BV(WDTIE) | wdp;
+    SREG = sreg;
+}
+
+#ifdef TURBO_TIMEOUT
+static uint16_t turbo_ticks; // slow watchdog periods left in turbo
+#endif
+
+#ifdef BATT_MONITOR
+static uint8_t batt_ticks; // watchdog periods left until the next sample
+#endif
+
+// pattern engine state, advanced by the watchdog interrupt or, for a
+// PATTERN_TIMER pattern, by timer_delay()
+static uint8_t pattern_i; // next step, offset in pattern_data
+static uint8_t pattern_first; // start of the playing pattern
+static uint8_t pattern_ticks; // watchdog periods left in this step
+static uint8_t pattern_timer; // PATTERN_TIMER of the playing pattern
+
+#ifdef TIMER_DELAY
+/* Timer0 delay. TIM0_OVF_vect adds a PWM period, TIMER_FRAC / 65536 ms,
+ * to timer_frac per overflow and counts timer_ms down on each carry. The
+ * fraction carries over into the next delay, so back to back delays do
+ * not drift. A delay ends within a PWM period of its length, and the
+ * rounding of TIMER_FRAC adds at most 0.5 / 65536 ms per period (70ppm
+ * at 9.4kHz). driver_host -t measures it.
+ */
+#define TIMER_FRAC ((uint16_t)(((uint32_t)PWM_PRESCALE * PWM_PERIOD * 65536 \
+                                + F_CPU / 2000) / (F_CPU / 1000)))
+static uint16_t timer_frac; // ms counted beyond timer_ms, in 1/65536
+
+// Start a delay of ms, and Timer0 if it is stopped. Not static,
+// driver_host -t calls it.
+void timer_delay(uint16_t ms)
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        timer_ms = ms;
     }
+    TCCR0A |= PWM_WGM;
+    TCCR0B = pwm_scl;
+    TIMSK0 |= _BV(TOIE0);
 }
+#endif
 
-// strobe using the STROBE_PIN. Note that PWM on that pin should not be
-// set up, or it should be disabled before calling this function.
-static void inline strobe()
+// Output the next step of the playing pattern
+static void pattern_step()
 {
-    while (1){
-        PORTB |= _BV(STROBE_PIN); // on
-        _delay_ms(20);
-        PORTB &= ~_BV(STROBE_PIN); // off
-        _delay_ms(90);
+    uint8_t lvl;
+
+    if (!pgm_read_byte(&(pattern_data[pattern_i + 1]))) // end, repeat
+    {
+        pattern_i = pattern_first;
+    }
+    lvl = pgm_read_byte(&(pattern_data[pattern_i]));
+    #ifdef BATT_MONITOR
+    if (lvl > lvl_max)
+    {
+        lvl = lvl_max;
+    }
+    #endif
+    #ifdef TIMER_DELAY
+    if (pattern_timer)
+    {
+        // first, see set_level()
+        timer_delay(pgm_read_byte(&(pattern_data[pattern_i + 1])));
+    }
+    else
+    #endif
+    {
+        pattern_ticks = pgm_read_byte(&(pattern_data[pattern_i + 1]));
     }
+    set_level(lvl);
+    pattern_i += 2;
 }
 
-static void inline sleep_ms(uint16_t ms)
+ISR(WDT_vect)
 {
-    while(ms >= 1){
-        _delay_ms(1);
-        --ms;
+    if (pattern_ticks && !--pattern_ticks)
+    {
+        pattern_step();
     }
+    #ifdef BATT_MONITOR
+    // sample the cell every WDT_SLOW_MS, also while a strobe pattern runs
+    // the watchdog at 16ms. See ADC_vect.
+    if (!batt_ticks--)
+    {
+        batt_ticks = (WDTCR & WDT_SLOW) ? 0 : WDT_TICKS(WDT_SLOW_MS) - 1;
+        ADCSRA |= _BV(ADEN) | _BV(ADSC); // on for this conversion only
+    }
+    #endif
+    #ifdef TURBO_TIMEOUT
+    if (turbo_ticks && !--turbo_ticks)
+    {
+        noinit.stepdown = 1; // remember after short power off
+        noinit_seal();
+        if (PWM_LVL > TURBO_STEPDOWN) // may be lower on a low cell
+        {
+            set_level(TURBO_STEPDOWN);
+        }
+    }
+    #endif
 }
 
-// Variable strobe
-// strobe using the STROBE_PIN. Note that PWM on that pin should not be
-// set up, or it should be disabled before calling this function.
-static void inline strobe2(uint8_t on, uint8_t off)
+#ifdef BATT_MONITOR
+// output ceilings used to step down on a low cell, same as modes 1-3
+uint8_t const stepdown_LVL[] PROGMEM = { 0x40, 0x10, 0x04 };
+static uint8_t batt_low; // low readings in a row
+static uint8_t batt_step; // next entry in stepdown_LVL
+
+ISR(ADC_vect)
 {
-    while (1){
-        PORTB |= _BV(STROBE_PIN); // on
-        sleep_ms(on);
-        PORTB &= ~_BV(STROBE_PIN); // off
-        sleep_ms(off);
+    uint8_t v = ADCH;
+    ADCSRA &= ~_BV(ADEN); // off until the next sample, also in power-down
+    if (v >= BATT_LOW)
+    {
+        batt_low = 0;
+        return;
+    }
+    if (++batt_low < BATT_SAMPLES)
+    {
+        return;
+    }
+    batt_low = 0;
+
+    if (v < BATT_CRIT)
+    {
+        lvl_max = 0; // protect the cell
     }
+    else if (batt_step < sizeof(stepdown_LVL))
+    {
+        lvl_max = pgm_read_byte(&(stepdown_LVL[batt_step++]));
+    }
+    if (PWM_LVL > lvl_max)
+    {
+        set_level(lvl_max);
+    }
+}
+
+// Set up the ADC and start sampling the cell from the watchdog. The ADC
+// stays disabled between samples, see WDT_vect.
+static inline void batt_init()
+{
+    ADMUX = _BV(REFS0) | _BV(ADLAR) | BATT_CHANNEL; // 1.1V ref, 8 bit
+    ADCSRA = _BV(ADIE) | _BV(ADPS2) | _BV(ADPS1); // clk/64
+    if (!(WDTCR & _BV(WDTIE))) // a strobe mode keeps its faster ticks
+    {
+        wdt_start(WDT_SLOW);
+    }
+}
+#endif
+
+// timer overflows between ramp steps in 1/16 of a period, so the steps
+// average out to RAMP_DELAY where it is not a whole number of periods
+// (4.4 at PWM_PRESCALE 64). Each step is still on a period boundary, up
+// to one period (27ms at 256) early or late.
+#define RAMP_CLOCKS (PWM_PRESCALE * PWM_PERIOD) // CPU clocks per overflow
+#define RAMP_TICKS16_N ((F_CPU / 1000 * RAMP_DELAY * 16 + RAMP_CLOCKS / 2) \
+                        / RAMP_CLOCKS)
+#if RAMP_TICKS16_N < 16
+#define RAMP_TICKS16 16
+#elif RAMP_TICKS16_N > 32767
+#error "RAMP_DELAY too long for this PWM frequency"
+#else
+#define RAMP_TICKS16 ((int16_t)RAMP_TICKS16_N)
+#endif
+
+#ifdef RAMP_GENERATOR
+/* Ramp curve generator, a drop-in for the profile decoder below. The
+ * SIN_SQUARED profile is 5 + 250 * sin^4(pi/2 * i/99), so it steps a
+ * rotation (x, y) = GEN_A * (cos, sin)(pi * i/99) with integer shifts,
+ * takes s = (1 - cos) / 2 = sin^2 as 8 bits and outputs 5 + 250/256 * s^2.
+ * The rotation is a Minsky circle, y += e*x then x -= e*y with
+ * e = 2^-5 + 2^-11 (pi/99 to 0.02%), which runs exactly backwards too.
+ * GEN_Y0 is tuned so all 100 levels are within 1 of SIN_SQUARED.
+ */
+#define GEN_A 16384
+#define GEN_Y0 -150
+
+static int16_t gen_x;
+static int16_t gen_y;
+static uint8_t const lut_n = RAMP_MAX_LEN;
+static volatile uint8_t lut_i;
+static volatile uint8_t lut_lvl;
+
+// Output level for the current rotation
+static void gen_level()
+{
+    uint16_t s = (uint16_t)(GEN_A - gen_x) >> 7;
+    if (s > 0xFF)
+    {
+        s = 0xFF;
+    }
+    s = (s * s) >> 8;
+    lut_lvl = 5 + s - (s >> 6) - (s >> 7);
+}
+
+static void lut_next()
+{
+    gen_y += (gen_x >> 5) + (gen_x >> 11);
+    gen_x -= (gen_y >> 5) + (gen_y >> 11);
+    ++lut_i;
+    gen_level();
+}
+
+static void lut_prev()
+{
+    gen_x += (gen_y >> 5) + (gen_y >> 11);
+    gen_y -= (gen_x >> 5) + (gen_x >> 11);
+    --lut_i;
+    gen_level();
+}
+
+static uint8_t lut_seek(uint8_t i)
+{
+    lut_i = 0;
+    gen_x = GEN_A;
+    gen_y = GEN_Y0;
+    gen_level();
+    while (lut_i != i){
+        lut_next();
+    }
+    return lut_lvl;
+}
+
+#define lut_select(p)
+#else
+/* Streaming decoder for the packed ramp profiles. lut_lvl is the level
+ * at index lut_i, and lut_pos the nibble holding the difference to the
+ * next level. Stepping either way costs a nibble read or two, random
+ * access decodes from the start.
+ */
+static uint8_t lut_p; // selected profile, offset in ramp_profiles
+static uint8_t lut_n; // number of levels in the profile
+static volatile uint8_t lut_i;
+static volatile uint8_t lut_pos;
+static volatile uint8_t lut_lvl;
+
+static uint8_t lut_nibble(uint8_t n)
+{
+    uint8_t b = pgm_read_byte(&(ramp_profiles[lut_p + 2 + (n >> 1)]));
+    return (n & 1) ? (b & 0x0F) : (b >> 4);
+}
+
+// Move to the next level of the profile
+static void lut_next()
+{
+    uint8_t d;
+    do {
+        d = lut_nibble(lut_pos++);
+        lut_lvl += d;
+    } while (d == 0x0F);
+    ++lut_i;
+}
+
+// Move to the previous level of the profile. A difference ends with the
+// first nibble that is not 0xF, so any 0xF before it belongs to it.
+static void lut_prev()
+{
+    lut_lvl -= lut_nibble(--lut_pos);
+    while (lut_pos && lut_nibble(lut_pos - 1) == 0x0F){
+        lut_lvl -= 0x0F;
+        --lut_pos;
+    }
+    --lut_i;
+}
+
+// Move to level i of the profile
+static uint8_t lut_seek(uint8_t i)
+{
+    lut_i = 0;
+    lut_pos = 0;
+    lut_lvl = pgm_read_byte(&(ramp_profiles[lut_p]));
+    while (lut_i != i){
+        lut_next();
+    }
+    return lut_lvl;
 }
 
+// Select the ramp profile at offset p in ramp_profiles
+static void lut_select(uint8_t p)
+{
+    lut_p = p;
+    lut_n = pgm_read_byte(&(ramp_profiles[p + 1]));
+}
+#endif
+
+#if SOFT_START_MS
+#ifdef RAMP_GENERATOR
+// A generator step costs a few hundred cycles (the ATtiny13 has no
+// multiplier), so take one per PWM period, and one every other period
+// where a period is only 256 cycles. The fade then lasts RAMP_MAX_LEN
+// steps, longer than SOFT_START_MS (10.6ms at 9.4kHz).
+#define FADE_STEP 1
+#if PWM_MODE == PWM_FAST \
+    && (PWM_PRESCALE == 1 || (defined(CLOCK_SCALING) && PWM_PRESCALE == 8))
+#define FADE_EVERY 2
+#endif
+#else
+// PWM periods to fade over, and profile levels skipped per period
+#define FADE_PERIODS ((uint32_t)SOFT_START_MS * PWM_TICK_HZ / 1000 + 1)
+#define FADE_STEP ((uint8_t)((RAMP_MAX_LEN + FADE_PERIODS - 1) \
+                  / FADE_PERIODS))
+#endif
+
+static volatile uint8_t fade_target; // level to end at, 0 if not fading
+static uint8_t fade_end; // profile index to end at
+#ifdef FADE_EVERY
+static uint8_t fade_wait; // periods since the last fade step
+#endif
+#endif
+
+// ramp engine state, advanced by the timer overflow interrupt. The
+// index and direction live in noinit.ramp_i and noinit.ramp_down.
+static volatile uint8_t ramp_bounce; // reverse at the top instead of restarting
+static volatile int16_t ramp_ticks; // 1/16 overflows left until the next step
+
+#if SOFT_START_MS
+// One fade step per PWM period, called from TIM0_OVF_vect
+static inline void fade_step()
+{
+    uint8_t n = FADE_STEP;
+
+    #ifdef FADE_EVERY
+    if (++fade_wait < FADE_EVERY)
+    {
+        return;
+    }
+    fade_wait = 0;
+    #endif
+
+    while (n-- && lut_i < fade_end){
+        lut_next();
+    }
+    if (lut_lvl < fade_target && lut_i < fade_end)
+    {
+        PWM_LVL = lut_lvl;
+        return;
+    }
+    n = (lut_lvl < fade_target) ? lut_lvl : fade_target;
+    fade_target = 0;
+    if (ramp_ticks) // ramp mode, the ramp engine goes on from here
+    {
+        set_pwm(n);
+        return;
+    }
+    TIMSK0 &= ~_BV(TOIE0);
+    set_level(n);
+}
+
+// Fade in from the bottom of the ramp profile, up to level lvl or index
+// end, whichever comes first. Returns 0 if the bottom level is already
+// as high, and the caller sets the level itself.
+static uint8_t fade_start(uint8_t lvl, uint8_t end)
+{
+    uint8_t first = lut_seek(0);
+    if (lvl <= first || !end)
+    {
+        return 0;
+    }
+    fade_target = lvl;
+    fade_end = (end < lut_n - 1) ? end : lut_n - 1;
+    set_level(first);
+    TIMSK0 |= _BV(TOIE0);
+    return 1;
+}
+#endif
+
+// Set a mode level, fading in along the ramp profile if enabled
+static void soft_start(uint8_t lvl)
+{
+    #if SOFT_START_MS
+    if (fade_start(lvl, 0xFF))
+    {
+        return;
+    }
+    #endif
+    set_level(lvl);
+}
+
+/* Ramp engine, one step every RAMP_TICKS16 / 16 timer overflows. The
+ * CPU sleeps in idle mode between steps (the timer and PWM keep
+ * running). Also runs timer_delay() and the soft-start fade, see
+ * fade_start().
+ */
+ISR(TIM0_OVF_vect)
+{
+    #ifdef TIMER_DELAY
+    if (timer_ms)
+    {
+        uint16_t f = timer_frac + TIMER_FRAC;
+        if (f < timer_frac && !--timer_ms && pattern_timer) // 1ms carried
+        {
+            pattern_step(); // starts the next delay
+        }
+        timer_frac = f;
+        return;
+    }
+    #endif
+
+    #if SOFT_START_MS
+    if (fade_target)
+    {
+        fade_step();
+        return;
+    }
+    #endif
+
+    ramp_ticks -= 16;
+    if (ramp_ticks > 0)
+    {
+        return;
+    }
+    ramp_ticks += RAMP_TICKS16; // keep the remainder for the next step
+
+    if (noinit.ramp_down)
+    {
+        lut_prev();
+        if (lut_i == 0)
+        {
+            noinit.ramp_down = 0;
+        }
+    }
+    else if (lut_i == lut_n - 1)
+    {
+        // the top step is shown twice when bouncing, as in the
+        // original forwards/backwards loops
+        if (ramp_bounce)
+        {
+            noinit.ramp_down = 1;
+        }
+        else
+        {
+            lut_seek(0);
+        }
+    }
+    else
+    {
+        lut_next();
+    }
+
+    noinit.ramp_i = lut_i; // remember after short power off
+    noinit_seal();
+    PWM_LVL = lut_lvl;
+    #ifdef BATT_MONITOR
+    if (PWM_LVL > lvl_max)
+    {
+        PWM_LVL = lvl_max;
+    }
+    #endif
+}
+
+// Start the ramp engine where it was left, see noinit.ramp_i. It fades
+// in to that index first, so no seek comes before the light is on.
+static void ramp_start(uint8_t bounce)
+{
+    ramp_bounce = bounce;
+    if (!bounce)
+    {
+        noinit.ramp_down = 0;
+    }
+    ramp_ticks = RAMP_TICKS16;
+    #if SOFT_START_MS
+    if (fade_start(0xFF, noinit.ramp_i))
+    {
+        return;
+    }
+    #endif
+    set_pwm(lut_seek(noinit.ramp_i)); // also at the top, see set_pwm()
+    TIMSK0 |= _BV(TOIE0);
+}
+
+/* Rise-Fall Ramping brightness selection /\/\/\/\
+ * cycle through PWM values from the ramp profile. Traverse it forwards,
+ * then backwards. The current profile index and direction are
+ * saved in noinit memory so the ramp resumes there at next startup
+ * (after a short press).
+*/
+void ramp()
+{
+    ramp_start(1);
+}
+
+/* Rising Ramping brightness selection //////
+ * Cycle through PWM values from the ramp profile. The current profile
+ * index is saved in noinit.ramp_i so it is available at next startup
+ * (after a short press)
+*/
+void ramp2()
+{
+    ramp_start(0);
+}
+
+/* Play strobe pattern n from pattern_data forever. Static levels let
+ * the MCU power down between edges, see set_level(), unless Timer0
+ * times the pattern.
+ */
+static void pattern_play(uint8_t n)
+{
+    uint8_t at = pgm_read_byte(&(pattern_start[n]));
+    pattern_timer = at & PATTERN_TIMER;
+    pattern_first = at & ~PATTERN_TIMER;
+    pattern_i = pattern_first;
+    pattern_step();
+    if (!pattern_timer)
+    {
+        wdt_start(0); // 16ms
+    }
+}
+
+// Power down unused peripherals and start the background tasks, once
+// the output is set
+static inline void background_start()
+{
+    power_gate();
+
+    #ifdef BATT_MONITOR
+    batt_init();
+    #endif
+}
+
+// main() never returns (sleep_loop), so the call-saved registers it
+// uses need no saving. avr-gcc 8 and later assume this for main(), older
+// ones push them, and they stay on the stack under every interrupt. With
+// MIN_STARTUP it is entered by a jump from crt_min.S.
+int main(void) OS_MAIN;
+
 int main(void)
 {
-    if (noinit_decay) // not short press, all noinit data invalid
+    uint8_t kind, param;
+
+    // Time to first light matters on the momentary half-press used for
+    // mode switching. Only the mode decision (one CRC pass over noinit)
+    // comes before the output is set. Resealing noinit, the fade or ramp
+    // to a stored profile index and the background tasks follow.
+    // not short press (or decayed), all noinit data invalid
+    if (noinit.decay || noinit_crc() != noinit.crc)
     {
-        noinit_mode = 0;
-        noinit_short = 0; // reset short counter
-        noinit_strobe = 0;
-        noinit_strobe_mode = 0;
-        noinit_lvl = 0;
+        noinit.mode = 0;
+        noinit.shorts = 0; // reset short counter
+        noinit.strobe = 0;
+        noinit.strobe_mode = 0;
+        noinit.ramp_i = 0;
+        noinit.ramp_down = 0;
+        noinit.stepdown = 0;
 
         #ifdef  MODE_MEMORY // get mode from eeprom
-        noinit_mode =  eeprom_read_byte(&MODE_P);
-		noinit_lvl = eeprom_read_byte(&LVL_P);
+        noinit.mode =  eeprom_read_byte(&MODE_P);
+		noinit.ramp_i = eeprom_read_byte(&LVL_P);
         #endif
     }
     else
     {
-        ++noinit_mode;
-        ++noinit_short;
+        #ifdef TURBO_TIMEOUT
+        if (noinit.stepdown) // restore turbo, stay in this mode
+        {
+            noinit.stepdown = 0;
+        }
+        else
+        #endif
+        {
+            ++noinit.mode;
+        }
+        ++noinit.shorts;
+        if (noinit.strobe) // next extended mode
+        {
+            ++noinit.strobe_mode;
+        }
     }
 
-	noinit_decay = 0;
+	noinit.decay = 0;
 
     // mode needs to loop back around
     // (or the mode is invalid)
-    if (noinit_mode > 5) // there are 6 modes
+    if (noinit.mode >= MODES)
     {
-        noinit_mode = 0;
+        noinit.mode = 0;
     }
     
-    if (noinit_short > 2 && !noinit_strobe)
+    if (noinit.shorts > 2 && !noinit.strobe)
+    {
+        noinit.strobe = 1;
+        noinit.strobe_mode = 0;
+    }
+
+    kind = pgm_read_byte(&(mode_table[noinit.mode].kind));
+    param = pgm_read_byte(&(mode_table[noinit.mode].param));
+
+    // ramp modes name their profile, steady modes fade in along the default
+    lut_select((kind == MODE_RAMP || kind == MODE_RAMP_SEL) ? param
+                                                             : RAMP_PROFILE);
+    if (noinit.ramp_i >= lut_n) // invalid (erased eeprom)
     {
-        noinit_strobe = 1;
-        noinit_strobe_mode = 0;
+        noinit.ramp_i = 0;
     }
 
-    if (noinit_strobe_mode > 0) // only 1 strobe mode, could add more...
+    if (noinit.strobe_mode >= STROBE_MODES)
     {
-        noinit_strobe_mode = 0; // loop back to first mode
+        noinit.strobe_mode = 0; // loop back to first mode
     }
 
-    //setup pins for output. Note that these pins could be the same pin
-    DDRB |= _BV(PWM_PIN) | _BV(STROBE_PIN);
+    //setup pin for output
+    DDRB |= _BV(PWM_PIN);
 
-    // extended modes, 1 for now, leaving extra code in case I want to
-    // add more strobes later
-    if (noinit_strobe)
+    // extended modes
+    if (noinit.strobe)
     {
-        switch(noinit_strobe_mode){
-            case 0:
-            strobe();
-            break;
-        }
+        pattern_play(noinit.strobe_mode);
+        noinit_seal(); // from here on the ISRs reseal what they change
+        background_start();
+        sleep_loop();
     }
 
-    // Initialise PWM on output pin and set level to zero
-    TCCR0A = PWM_TCR;
-    TCCR0B = PWM_SCL;
+    // keep track of the number of very short on times, used to decide
+    // when to go into strobe mode. TIM0_COMPA_vect closes the window.
+    short_ticks = SHORT_TICKS;
+    OCR0A = 0xFF; // one match per period in either PWM mode
+    TIMSK0 |= _BV(OCIE0A);
 
-    PWM_LVL = 0;
-
-    switch(noinit_mode){
-        case 0:
-        PWM_LVL = 0xFF;
-        break;
-        case 1:
-        PWM_LVL = 0x40;
-        break;
-        case 2:
-        PWM_LVL = 0x10;
-        break;
-        case 3:
-        PWM_LVL = 0x04;
+    switch(kind){
+        case MODE_STEADY:
+        soft_start(param);
+        #ifdef TURBO_TIMEOUT
+        if (param == 0xFF)
+        {
+            turbo_ticks = (uint16_t)((uint32_t)TURBO_TIMEOUT * 1000 / WDT_SLOW_MS);
+            wdt_start(WDT_SLOW);
+        }
+        #endif
         break;
-        case 4:
-        #ifdef MODE_MEMORY // remember mode in eeprom
-        // save mode without delay, since ramp() will not return.
-	    eeprom_busy_wait(); //make sure eeprom is ready
-	    eeprom_write_byte(&MODE_P, noinit_mode); // save mode
-	    #endif
+        case MODE_RAMP:
         ramp(); // ramping brightness selection
         break;
-        case 5:
-        PWM_LVL = noinit_lvl; // use value selected by ramping function
+        case MODE_RAMP_SEL:
+        // use level selected by ramping function, fading in to its index
+        #if SOFT_START_MS
+        if (fade_start(0xFF, noinit.ramp_i))
+        {
+            break;
+        }
+        #endif
+        set_level(lut_seek(noinit.ramp_i));
+        break;
+        case MODE_STROBE:
+        pattern_play(param);
         break;
     }
 
-    // keep track of the number of very short on times
-    // used to decide when to go into strobe mode
-    _delay_ms(25); // on for too long
-    noinit_short = 0; // reset short press counter
-    
-    #ifdef MODE_MEMORY // remember mode in eeprom
-    eeprom_busy_wait(); //make sure eeprom is ready
-    eeprom_write_byte(&MODE_P, noinit_mode); // save mode
-    // only save level if it was set, to reduce writes. Not based on 
-    // mode number in case mode orders change in code.
-    if (noinit_lvl != 0)
-    {
-		eeprom_busy_wait(); //make sure eeprom is ready
-	    eeprom_write_byte(&LVL_P, noinit_lvl); // save level
-	}
-    #endif
-    while(1);
+    // the light is on, the ramp engine and background tasks can run
+    noinit_seal(); // from here on the ISRs reseal what they change
+    sei();
+
+    background_start();
+
+    clock_scale();
+
+    // nothing left to do. set_level() picked idle sleep if Timer0 is
+    // generating PWM, or power-down if the output is static.
+    sleep_loop();
     return 0;
 }
@@ -0,0 +1,368 @@
+/*
+ * Run the real firmware image in simavr.
+ *
+ *   ./driver_sim [-k retain_ms] [-b mv] [-v out.vcd] [-c name] driver.hex
+ *                on_ms [off_ms on_ms ...]
+ *
+ * Loads driver.hex (or driver.elf) into a simulated ATtiny13 at 4.8MHz
+ * and powers it on and off with the given times. SRAM is kept over an
+ * off time of up to retain_ms (default 500) and decays to all ones over
+ * a longer one, EEPROM is always kept. -b sets the voltage on the
+ * battery divider pin PB2 in mV (default 860, about ADC 200).
+ *
+ * Prints the output level each time it changes, in the format of the
+ * host build (hal_host.c) so check.py can run either:
+ *   on <ms> ms, boot <n>   power on
+ *   <time> ms  <level>     level 0 to 255, time since power on
+ *   off <ms> ms            power off
+ * and with -v writes PB1 and OCR0B to a VCD file for a waveform viewer.
+ *
+ * With -c the event log is replaced by one JSON object per power cycle,
+ * tagged with the given run name, for tracking cycle counts:
+ *   boot          boot number in this run
+ *   on_ms         on time
+ *   light_cycles  reset to first light, the first cycle PB1 is driven
+ *                 (a non-zero output level)
+ *   boot_cycles   reset to the first sleep, when main() has set the output
+ *   settle_cycles reset to the last OCR0B change (end of a fade or ramp)
+ *   awake_cycles  cycles not spent asleep, main() and interrupts
+ *   writes        OCR0B changes, one per fade or ramp step
+ *   awake_per_write  awake_cycles after the first sleep / writes since,
+ *                 the cost of a step including the idle timer ticks
+ *   crc_first     cycles of the first noinit_crc() call, the check of
+ *                 the noinit block in main()
+ *   crc_calls     noinit_crc() calls after the first, one per reseal
+ *   crc_per_call  their mean cycles, the reseal cost of a step
+ * The crc fields need the symbol table of an .elf image, they are 0 for
+ * a .hex.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#define _BV(bit) (1 << (bit))
+#include "sim_avr.h"
+#include "sim_elf.h"
+#include "sim_hex.h"
+#include "sim_io.h"
+#include "sim_vcd_file.h"
+#include "avr_ioport.h"
+#include "avr_adc.h"
+
+#define F_CPU 4800000 // as in driver.c
+#define SRAM_START 0x60
+// data space addresses on the ATtiny13
+#define DDRB_ADDR 0x37
+#define PORTB_ADDR 0x38
+#define OCR0B_ADDR 0x49
+#define SPL_ADDR 0x5D
+#define TCCR0A_ADDR 0x4F
+#define PB1 1
+#define COM0B1 5
+
+static avr_t *avr;
+static avr_cycle_count_t boot_cycle; // cycle count at power on
+static avr_irq_t *ocr0b_irq; // OCR0B changes, for the VCD file
+static uint8_t ocr0b; // last OCR0B seen
+static char const *bench; // run name with -c, log events otherwise
+static int out; // last output level printed
+static uint32_t crc_addr; // flash byte address of noinit_crc(), 0 if unknown
+
+// cycle counts of the current power cycle, see -c
+static struct {
+    avr_cycle_count_t light, boot, settle, awake, awake_after_boot;
+    unsigned writes, writes_after_boot;
+    avr_cycle_count_t crc_first, crc_rest, crc_start;
+    unsigned crc_calls;
+    int crc_sp; // SP inside noinit_crc(), -1 when not in it
+} count;
+
+static double now_ms(void)
+{
+    return (avr->cycle - boot_cycle) * 1000.0 / F_CPU;
+}
+
+// output level on PWM pin PB1, 0 to 255, as output() in hal_host.c
+static int output(void)
+{
+    if (!(avr->data[DDRB_ADDR] & _BV(PB1)))
+    {
+        return 0;
+    }
+    if (avr->data[TCCR0A_ADDR] & _BV(COM0B1))
+    {
+        return avr->data[OCR0B_ADDR];
+    }
+    return (avr->data[PORTB_ADDR] & _BV(PB1)) ? 0xFF : 0;
+}
+
+static void trace(void)
+{
+    if (!bench && output() != out)
+    {
+        out = output();
+        printf("%10.1f ms  %3d\n", now_ms(), out);
+    }
+}
+
+/* The timer module owns the OCR0B write handler, so writes are found by
+ * comparing the register after each instruction. Writing the same value
+ * again is not counted.
+ */
+static void ocr0b_poll(void)
+{
+    uint8_t v = avr->data[OCR0B_ADDR];
+    if (v == ocr0b)
+    {
+        return;
+    }
+    ocr0b = v;
+    count.settle = avr->cycle - boot_cycle;
+    ++count.writes;
+    if (count.boot)
+    {
+        ++count.writes_after_boot;
+    }
+    avr_raise_irq(ocr0b_irq, v);
+}
+
+/* noinit_crc() is entered when the PC reaches its first instruction and
+ * left when SP rises above its value there, by the ret popping the
+ * return address. The count includes any interrupt taken during it.
+ */
+static void crc_poll(void)
+{
+    int sp = avr->data[SPL_ADDR];
+    if (count.crc_sp < 0)
+    {
+        if (crc_addr && avr->pc == crc_addr)
+        {
+            count.crc_sp = sp;
+            count.crc_start = avr->cycle;
+        }
+        return;
+    }
+    if (sp <= count.crc_sp)
+    {
+        return;
+    }
+    avr_cycle_count_t n = avr->cycle - count.crc_start;
+    if (!count.crc_first)
+    {
+        count.crc_first = n;
+    }
+    else
+    {
+        count.crc_rest += n;
+        ++count.crc_calls;
+    }
+    count.crc_sp = -1;
+}
+
+static int load(char const *name)
+{
+    size_t len = strlen(name);
+    if (len > 4 && !strcmp(name + len - 4, ".elf"))
+    {
+        elf_firmware_t f;
+        memset(&f, 0, sizeof(f));
+        if (elf_read_firmware(name, &f))
+        {
+            return -1;
+        }
+        avr_load_firmware(avr, &f);
+        for (uint32_t i = 0; i < f.symbolcount; ++i)
+        {
+            if (!strcmp(f.symbol[i]->symbol, "noinit_crc"))
+            {
+                crc_addr = f.symbol[i]->addr;
+            }
+        }
+        return 0;
+    }
+
+    ihex_chunk_p chunks = NULL;
+    int n = read_ihex_chunks(name, &chunks);
+    if (n <= 0)
+    {
+        return -1;
+    }
+    for (int i = 0; i < n; ++i)
+    {
+        if (chunks[i].baseaddr < avr->flashend)
+        {
+            avr_loadcode(avr, chunks[i].data, chunks[i].size,
+                         chunks[i].baseaddr);
+        }
+    }
+    free_ihex_chunks(chunks);
+    return 0;
+}
+
+// run until on_ms have passed, or the core stops
+static void power_on(unsigned long on_ms)
+{
+    avr_cycle_count_t end = avr->cycle
+                            + (avr_cycle_count_t)on_ms * (F_CPU / 1000);
+    memset(&count, 0, sizeof(count));
+    count.crc_sp = -1;
+    out = -1;
+    ocr0b = avr->data[OCR0B_ADDR];
+    while (avr->cycle < end)
+    {
+        avr_cycle_count_t start = avr->cycle;
+        int awake = avr->state == cpu_Running;
+        int state = avr_run(avr);
+        ocr0b_poll();
+        crc_poll();
+        trace();
+        if (!count.light && output())
+        {
+            count.light = avr->cycle - boot_cycle;
+        }
+        if (awake)
+        {
+            count.awake += avr->cycle - start;
+            if (count.boot)
+            {
+                count.awake_after_boot += avr->cycle - start;
+            }
+        }
+        if (state == cpu_Sleeping && !count.boot)
+        {
+            count.boot = avr->cycle - boot_cycle;
+        }
+        if (state == cpu_Done || state == cpu_Crashed)
+        {
+            printf("%10.3f core stopped (%d)\n", now_ms(), state);
+            break;
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long retain_ms = 500;
+    uint32_t batt_mv = 860;
+    char const *vcd_name = NULL;
+    avr_vcd_t vcd;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "k:b:v:c:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'k':
+            retain_ms = strtoul(optarg, NULL, 0);
+            break;
+        case 'b':
+            batt_mv = strtoul(optarg, NULL, 0);
+            break;
+        case 'v':
+            vcd_name = optarg;
+            break;
+        case 'c':
+            bench = optarg;
+            break;
+        default:
+            optind = argc; // print usage
+        }
+    }
+    if (argc - optind < 2)
+    {
+        fprintf(stderr, "usage: %s [-k retain_ms] [-b mv] [-v out.vcd] "
+                "[-c name] driver.hex on_ms [off_ms on_ms ...]\n", argv[0]);
+        return 2;
+    }
+
+    avr = avr_make_mcu_by_name("attiny13");
+    if (!avr)
+    {
+        fprintf(stderr, "simavr has no attiny13 core\n");
+        return 1;
+    }
+    avr_init(avr);
+    avr->frequency = F_CPU;
+    if (load(argv[optind]))
+    {
+        fprintf(stderr, "can not load %s\n", argv[optind]);
+        return 1;
+    }
+
+    avr_irq_t *pb1 = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), 1);
+    static char const *ocr0b_name = "OCR0B";
+    ocr0b_irq = avr_alloc_irq(&avr->irq_pool, 0, 1, &ocr0b_name);
+
+    if (vcd_name)
+    {
+        avr_vcd_init(avr, vcd_name, &vcd, 10 /* us */);
+        avr_vcd_add_signal(&vcd, pb1, 1, "PB1");
+        avr_vcd_add_signal(&vcd, ocr0b_irq, 8, "OCR0B");
+        avr_vcd_start(&vcd);
+    }
+
+    int sram_len = avr->ramend + 1 - SRAM_START;
+    uint8_t *sram = malloc(sram_len);
+    memset(sram, 0xFF, sram_len); // cold start
+    int boot = 0;
+
+    for (int i = optind + 1; i < argc; i += 2)
+    {
+        if (boot)
+        {
+            unsigned long off_ms = strtoul(argv[i - 1], NULL, 0);
+            memcpy(sram, avr->data + SRAM_START, sram_len);
+            if (off_ms > retain_ms)
+            {
+                memset(sram, 0xFF, sram_len);
+            }
+            if (!bench)
+            {
+                printf("off %lu ms\n", off_ms);
+            }
+        }
+        avr_reset(avr);
+        memcpy(avr->data + SRAM_START, sram, sram_len);
+        avr_raise_irq(avr_io_getirq(avr, AVR_IOCTL_ADC_GETIRQ, ADC_IRQ_ADC1),
+                      batt_mv);
+        boot_cycle = avr->cycle;
+        ++boot;
+        if (!bench)
+        {
+            printf("on %s ms, boot %d\n", argv[i], boot);
+        }
+        power_on(strtoul(argv[i], NULL, 0));
+        if (bench)
+        {
+            printf("{\"run\": \"%s\", \"boot\": %d, \"on_ms\": %s, "
+                   "\"light_cycles\": %llu, \"boot_cycles\": %llu, \"settle_cycles\": %llu, "
+                   "\"awake_cycles\": %llu, \"writes\": %u, "
+                   "\"awake_per_write\": %llu, \"crc_first\": %llu, "
+                   "\"crc_calls\": %u, \"crc_per_call\": %llu}\n",
+                   bench, boot, argv[i],
+                   (unsigned long long)count.light,
+                   (unsigned long long)count.boot,
+                   (unsigned long long)count.settle,
+                   (unsigned long long)count.awake, count.writes,
+                   (unsigned long long)(count.writes_after_boot
+                       ? count.awake_after_boot / count.writes_after_boot
+                       : 0),
+                   (unsigned long long)count.crc_first, count.crc_calls,
+                   (unsigned long long)(count.crc_calls
+                       ? count.crc_rest / count.crc_calls : 0));
+        }
+    }
+
+    if (vcd_name)
+    {
+        avr_vcd_stop(&vcd);
+        avr_vcd_close(&vcd);
+    }
+    free(sram);
+    return 0;
+}
@@ -0,0 +1,39 @@
+/*
+ * Hardware abstraction for driver.c.
+ *
+ * The firmware is written against the avr-libc register and helper
+ * names. An AVR build gets avr-libc itself. With HOST defined the same
+ * names come from hal_host.h instead, backed by plain variables, and
+ * hal_host.c plays the part of the timer, watchdog, ADC and EEPROM so
+ * the mode and off-time logic can run on a PC.
+ *
+ * NOINIT places a variable in memory that is not cleared at startup,
+ * so it survives a short power off. OS_MAIN marks main() as entered with
+ * interrupts off and never returning, so it saves no registers.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+#ifndef HAL_H
+#define HAL_H
+
+#ifdef HOST
+#include "hal_host.h"
+#else
+#include <avr/io.h>
+#include <stdlib.h>
+#include <avr/eeprom.h>
+#include <avr/pgmspace.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include <avr/power.h>
+#include <avr/wdt.h>
+#include <util/atomic.h>
+
+#define NOINIT __attribute__ ((section (".noinit")))
+#define OS_MAIN __attribute__ ((OS_main))
+#endif
+
+#endif
@@ -0,0 +1,447 @@
+/*
+ * Host harness for driver.c, see hal_host.h.
+ *
+ * Runs the firmware through a series of power cycles and prints the
+ * output level each time it changes:
+ *
+ *   ./driver_host [-b adc] on_ms [off_ms on_ms ...]
+ *   ./driver_host -d trials
+ *   ./driver_host -t
+ *
+ * Each on time is a fresh process (fork), so .data and .bss start over
+ * as they do after a reset, while the noinit and EEPROM sections are
+ * carried over from the previous power cycle. An off time longer than
+ * RETAIN_MS decays every noinit bit to 1. -b sets the ADC reading of
+ * the cell (8 bit, default 200).
+ *
+ * Time only passes while the firmware sleeps. hal_sleep() moves the
+ * clock to the next timer period, watchdog timeout, ADC conversion or
+ * EEPROM write and runs its interrupt handler.
+ *
+ * -d benchmarks the noinit check instead: for each decay level it seals
+ * the given number of random valid blocks with the firmware's
+ * noinit_crc(), sets each 0 bit to 1 with that probability, and counts
+ * the decayed blocks the check in main() would still accept. It also
+ * prints the host time of one noinit_crc() call.
+ *
+ * -t tests the firmware's Timer0 delay: it runs timer_delay() back to
+ * back, as a PATTERN_TIMER pattern does, for lengths across the uint16_t
+ * range and prints how long each took on the simulated clock. It fails
+ * if a delay or the total is off by more than a PWM period plus 100ppm.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "hal_host.h"
+#undef main // this file has the real one
+
+#define F_CPU 4800000UL // as in driver.c
+#define RETAIN_MS 500 // longest off time the noinit data survives
+#define EE_WRITE_NS 3400000 // erase and write of one EEPROM byte
+#define ADC_NS 200000 // one conversion at clk/64
+
+volatile uint8_t ACSR, ADCH, ADCSRA, ADMUX, CLKPR, DDRB, DIDR0;
+volatile uint8_t EEARL, EECR, MCUCR, OCR0A, OCR0B, PORTB, PRR;
+volatile uint8_t SREG, TCCR0A, TCCR0B, TIMSK0, WDTCR;
+static volatile uint8_t eedr;
+
+// section bounds from the linker, the eeprom one may not exist
+extern uint8_t __start_hal_noinit[] __attribute__ ((weak));
+extern uint8_t __stop_hal_noinit[] __attribute__ ((weak));
+extern uint8_t __start_hal_eeprom[] __attribute__ ((weak));
+extern uint8_t __stop_hal_eeprom[] __attribute__ ((weak));
+
+// interrupt handlers, each only exists if its feature is enabled
+void TIM0_OVF_vect(void) __attribute__ ((weak));
+void TIM0_COMPA_vect(void) __attribute__ ((weak));
+void WDT_vect(void) __attribute__ ((weak));
+void ADC_vect(void) __attribute__ ((weak));
+void EE_RDY_vect(void) __attribute__ ((weak));
+
+int fw_main(void);
+uint8_t noinit_crc(void);
+void timer_delay(uint16_t ms) __attribute__ ((weak)); // see TIMER_DELAY
+extern volatile uint16_t timer_ms;
+
+static uint8_t *saved; // noinit then EEPROM, shared across power cycles
+static uint64_t now_ns; // time since power on
+static uint64_t off_ns; // power is cut at this time
+static uint8_t batt = 200;
+static int out = -1; // last output level printed
+
+// next event of each source, 0 while it is stopped
+static uint64_t timer_next, wdt_next, adc_next, ee_next;
+
+static size_t noinit_len(void)
+{
+    return __stop_hal_noinit - __start_hal_noinit;
+}
+
+static size_t eeprom_len(void)
+{
+    if (!__start_hal_eeprom)
+    {
+        return 0;
+    }
+    return __stop_hal_eeprom - __start_hal_eeprom;
+}
+
+// driver.c addresses the EEPROM with the low byte of the pointer
+static uint8_t *eeprom_at(uint8_t addr)
+{
+    uint8_t i = addr - (uint8_t)(uintptr_t)__start_hal_eeprom;
+    return &__start_hal_eeprom[i % eeprom_len()];
+}
+
+uint8_t eeprom_read_byte(uint8_t const *p)
+{
+    return *p;
+}
+
+volatile uint8_t *hal_eedr(void)
+{
+    if (EECR & _BV(EERE))
+    {
+        EECR &= ~_BV(EERE);
+        eedr = *eeprom_at(EEARL);
+    }
+    return &eedr;
+}
+
+static uint64_t cpu_ns(uint64_t cycles)
+{
+    return (cycles << (CLKPR & 0x0F)) * 1000000000 / F_CPU;
+}
+
+// output level on PWM pin PB1, 0 to 255
+static uint8_t output(void)
+{
+    if (!(DDRB & _BV(PB1)))
+    {
+        return 0;
+    }
+    if (TCCR0A & _BV(COM0B1))
+    {
+        return OCR0B;
+    }
+    return (PORTB & _BV(PB1)) ? 0xFF : 0;
+}
+
+static void trace(void)
+{
+    if (output() != out)
+    {
+        out = output();
+        printf("%10.1f ms  %3d\n", now_ns / 1e6, out);
+    }
+}
+
+static void power_off(void)
+{
+    now_ns = off_ns;
+    memcpy(saved, __start_hal_noinit, noinit_len());
+    memcpy(saved + noinit_len(), __start_hal_eeprom, eeprom_len());
+    fflush(stdout);
+    _exit(0);
+}
+
+static uint64_t timer_period_ns(void)
+{
+    static uint16_t const prescale[] = { 0, 1, 8, 64, 256, 1024 };
+    uint16_t period = (TCCR0A & _BV(WGM01)) ? 256 : 510;
+    return cpu_ns((uint64_t)period * prescale[TCCR0B & 0x07]);
+}
+
+static uint64_t wdt_period_ns(void)
+{
+    uint8_t wdp = (WDTCR & 0x07) | ((WDTCR & _BV(WDP3)) >> 2);
+    return 16000000ULL << wdp;
+}
+
+// arm or stop an event source, keeping a running one on its schedule
+static void schedule(uint64_t *next, int running, uint64_t period)
+{
+    if (!running)
+    {
+        *next = 0;
+    }
+    else if (!*next)
+    {
+        *next = now_ns + period;
+    }
+}
+
+static void earliest(uint64_t *t, uint64_t next)
+{
+    if (next && next < *t)
+    {
+        *t = next;
+    }
+}
+
+/* Sleep until the next interrupt and run it. Timer0 only runs in idle
+ * sleep, the watchdog, ADC and EEPROM in any mode.
+ */
+void hal_sleep(void)
+{
+    uint64_t t = off_ns;
+    int idle = !(MCUCR & (_BV(SM1) | _BV(SM0)));
+
+    trace();
+    schedule(&timer_next, idle && (TCCR0B & 0x07)
+             && (TIMSK0 & (_BV(OCIE0A) | _BV(TOIE0))), timer_period_ns());
+    schedule(&wdt_next, WDTCR & _BV(WDTIE), wdt_period_ns());
+    if (!(ADCSRA & _BV(ADEN)))
+    {
+        ADCSRA &= ~_BV(ADSC); // a disabled ADC does not convert
+    }
+    schedule(&adc_next, ADCSRA & _BV(ADSC), ADC_NS);
+    schedule(&ee_next, EECR & _BV(EERIE),
+             (EECR & _BV(EEPE)) ? EE_WRITE_NS : 1000);
+    if (!(SREG & _BV(SREG_I)))
+    {
+        power_off(); // nothing can wake us
+    }
+    earliest(&t, timer_next);
+    earliest(&t, wdt_next);
+    earliest(&t, adc_next);
+    earliest(&t, ee_next);
+    if (t >= off_ns)
+    {
+        power_off();
+    }
+    now_ns = t;
+
+    cli(); // handlers run with interrupts off, as on the AVR
+    if (t == timer_next)
+    {
+        timer_next += timer_period_ns();
+        if ((TIMSK0 & _BV(OCIE0A)) && TIM0_COMPA_vect)
+        {
+            TIM0_COMPA_vect();
+        }
+        if ((TIMSK0 & _BV(TOIE0)) && TIM0_OVF_vect)
+        {
+            TIM0_OVF_vect();
+        }
+    }
+    if (t == wdt_next)
+    {
+        wdt_next += wdt_period_ns();
+        if (WDT_vect)
+        {
+            WDT_vect();
+        }
+    }
+    if (t == adc_next)
+    {
+        adc_next = 0;
+        ADCSRA &= ~_BV(ADSC);
+        ADCH = batt;
+        if ((ADCSRA & _BV(ADIE)) && ADC_vect)
+        {
+            ADC_vect();
+        }
+    }
+    if (t == ee_next)
+    {
+        ee_next = 0;
+        if (EECR & _BV(EEPE))
+        {
+            *eeprom_at(EEARL) = eedr;
+            EECR &= ~(_BV(EEPE) | _BV(EEMPE));
+        }
+        if (EE_RDY_vect)
+        {
+            EE_RDY_vect();
+        }
+    }
+    sei();
+    trace();
+}
+
+static void power_on(uint64_t on_ms)
+{
+    memcpy(__start_hal_noinit, saved, noinit_len());
+    memcpy(__start_hal_eeprom, saved + noinit_len(), eeprom_len());
+    off_ns = on_ms * 1000000;
+    fw_main();
+    power_off(); // main() returned, the AVR would restart it
+}
+
+// as main() in driver.c: valid if the decay byte is 0 and the CRC matches
+static int noinit_accepted(void)
+{
+    uint8_t *p = __start_hal_noinit;
+    return p[0] == 0 && p[noinit_len() - 1] == noinit_crc();
+}
+
+static int decay_bench(unsigned long trials)
+{
+    static int const pct[] = { 1, 5, 10, 25, 50, 75, 90, 99 };
+    uint8_t *p = __start_hal_noinit;
+    size_t len = noinit_len();
+
+    srand(1); // the same blocks every run
+    printf("decay  trials    changed  accepted  rate\n");
+    for (size_t k = 0; k < sizeof(pct) / sizeof(pct[0]); ++k)
+    {
+        unsigned long changed = 0, accepted = 0;
+        for (unsigned long t = 0; t < trials; ++t)
+        {
+            int flipped = 0;
+            p[0] = 0;
+            for (size_t i = 1; i < len - 1; ++i)
+            {
+                p[i] = rand();
+            }
+            p[len - 1] = noinit_crc(); // as noinit_seal()
+            for (size_t i = 0; i < len; ++i)
+            {
+                for (int b = 0; b < 8; ++b)
+                {
+                    if (!(p[i] & _BV(b)) && rand() % 100 < pct[k])
+                    {
+                        p[i] |= _BV(b);
+                        flipped = 1;
+                    }
+                }
+            }
+            changed += flipped;
+            accepted += flipped && noinit_accepted();
+        }
+        printf("%3d%%  %8lu  %8lu  %8lu  %.2e\n", pct[k], trials, changed,
+               accepted, changed ? (double)accepted / changed : 0.0);
+    }
+
+    struct timespec t0, t1;
+    volatile uint8_t sink = 0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (unsigned long t = 0; t < trials; ++t)
+    {
+        sink ^= noinit_crc();
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    printf("noinit_crc() %.1f ns on this host, %zu bytes\n",
+           ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec))
+           / trials, len - 1);
+    return 0;
+}
+
+static int timer_test(void)
+{
+    static uint16_t const len[] = { 1, 2, 3, 5, 10, 20, 40, 70, 100, 130,
+        255, 256, 1000, 4095, 4096, 10000, 32767, 32768, 65534, 65535 };
+    uint64_t start = 0, total = 0;
+    int failed = 0;
+
+    if (!timer_delay)
+    {
+        printf("no Timer0 delay at this PWM period\n");
+        return 0;
+    }
+    off_ns = UINT64_MAX;
+    out = 0; // nothing is output
+    sei();
+    printf("length ms    took ms  error us  error ppm\n");
+    for (size_t k = 0; k <= sizeof(len) / sizeof(len[0]); ++k)
+    {
+        uint64_t want;
+        if (k < sizeof(len) / sizeof(len[0]))
+        {
+            timer_delay(len[k]);
+            while (timer_ms)
+            {
+                hal_sleep();
+            }
+            want = len[k] * 1000000ULL;
+            total += want;
+        }
+        else // all of them
+        {
+            want = total;
+            start = 0;
+        }
+        double err = ((double)(now_ns - start) - want) / 1000;
+        int ok = (err < 0 ? -err : err) * 1000
+                 <= timer_period_ns() + want / 10000;
+        printf("%9llu  %9.3f  %8.1f  %9.1f  %s%s\n",
+               (unsigned long long)(want / 1000000),
+               (now_ns - start) / 1e6, err, err * 1e9 / want,
+               ok ? "pass" : "FAIL", want == total ? " total" : "");
+        failed |= !ok;
+        start = now_ns;
+    }
+    return failed;
+}
+
+int main(int argc, char **argv)
+{
+    int i = 1;
+    int boot = 0;
+
+    if (argc > 2 && !strcmp(argv[1], "-d"))
+    {
+        return decay_bench(strtoul(argv[2], NULL, 0));
+    }
+    if (argc == 2 && !strcmp(argv[1], "-t"))
+    {
+        return timer_test();
+    }
+    if (argc > 2 && !strcmp(argv[1], "-b"))
+    {
+        batt = (uint8_t)atoi(argv[2]);
+        i = 3;
+    }
+    if (i >= argc || argv[i][0] == '-')
+    {
+        fprintf(stderr, "usage: %s [-b adc] on_ms [off_ms on_ms ...]\n"
+                "       %s -d trials\n"
+                "       %s -t\n", argv[0], argv[0], argv[0]);
+        return 2;
+    }
+
+    saved = mmap(NULL, noinit_len() + eeprom_len() + 1,
+                 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (saved == MAP_FAILED)
+    {
+        perror("mmap");
+        return 1;
+    }
+    memset(saved, 0xFF, noinit_len() + eeprom_len()); // cold and erased
+
+    for (; i < argc; i += 2)
+    {
+        if (boot)
+        {
+            uint64_t off_ms = strtoull(argv[i - 1], NULL, 0);
+            if (off_ms > RETAIN_MS)
+            {
+                memset(saved, 0xFF, noinit_len());
+            }
+            printf("off %llu ms\n", (unsigned long long)off_ms);
+        }
+        printf("on %s ms, boot %d\n", argv[i], ++boot);
+        fflush(stdout);
+
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            power_on(strtoull(argv[i], NULL, 0));
+        }
+        if (pid < 0 || waitpid(pid, NULL, 0) < 0)
+        {
+            perror("fork");
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,133 @@
+/*
+ * Host side of hal.h: the avr-libc names driver.c uses, for a PC build.
+ *
+ * I/O registers are plain variables, with the ATtiny13 bit numbers.
+ * Interrupt handlers become ordinary functions that hal_host.c calls
+ * while the firmware is in sleep_cpu(), which is the only place the
+ * firmware waits. Reading EEDR after setting EERE returns the fake
+ * EEPROM, and a write started with EEPE lands there before the next
+ * interrupt. NOINIT variables go into the "hal_noinit" section, which
+ * the harness keeps or decays across power cycles.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+#ifndef HAL_HOST_H
+#define HAL_HOST_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#define _BV(bit) (1 << (bit))
+
+// I/O registers
+extern volatile uint8_t ACSR, ADCH, ADCSRA, ADMUX, CLKPR, DDRB, DIDR0;
+extern volatile uint8_t EEARL, EECR, MCUCR, OCR0A, OCR0B, PORTB, PRR;
+extern volatile uint8_t SREG, TCCR0A, TCCR0B, TIMSK0, WDTCR;
+volatile uint8_t *hal_eedr(void);
+#define EEDR (*hal_eedr())
+
+// PORTB, DDRB
+#define PB0 0
+#define PB1 1
+#define PB2 2
+#define PB3 3
+#define PB4 4
+#define PB5 5
+// TCCR0A
+#define COM0A1 7
+#define COM0A0 6
+#define COM0B1 5
+#define COM0B0 4
+#define WGM01 1
+#define WGM00 0
+// TIMSK0
+#define OCIE0B 3
+#define OCIE0A 2
+#define TOIE0 1
+// ACSR
+#define ACD 7
+// ADMUX
+#define REFS0 6
+#define ADLAR 5
+// ADCSRA
+#define ADEN 7
+#define ADSC 6
+#define ADIE 3
+#define ADPS2 2
+#define ADPS1 1
+#define ADPS0 0
+// DIDR0
+#define ADC0D 5
+#define ADC2D 4
+#define ADC3D 3
+#define ADC1D 2
+#define AIN1D 1
+#define AIN0D 0
+// PRR
+#define PRTIM0 1
+#define PRADC 0
+// EECR
+#define EERIE 3
+#define EEMPE 2
+#define EEPE 1
+#define EERE 0
+// WDTCR
+#define WDTIE 6
+#define WDP3 5
+#define WDCE 4
+#define WDE 3
+#define WDP2 2
+#define WDP1 1
+#define WDP0 0
+// MCUCR
+#define SE 5
+#define SM1 4
+#define SM0 3
+// SREG
+#define SREG_I 7
+
+// interrupts
+#define ISR(vector) void vector(void)
+#define sei() (SREG |= _BV(SREG_I))
+#define cli() (SREG &= ~_BV(SREG_I))
+#define ATOMIC_RESTORESTATE
+#define ATOMIC_BLOCK(type) \
+    for (uint8_t hal_sreg = SREG, hal_once = (cli(), 1); hal_once; \
+         SREG = hal_sreg, hal_once = 0)
+
+// sleep
+#define SLEEP_MODE_IDLE 0
+#define SLEEP_MODE_PWR_DOWN _BV(SM1)
+#define set_sleep_mode(mode) \
+    (MCUCR = (MCUCR & ~(_BV(SM1) | _BV(SM0))) | (mode))
+#define sleep_enable() (MCUCR |= _BV(SE))
+#define sleep_disable() (MCUCR &= ~_BV(SE))
+void hal_sleep(void);
+#define sleep_cpu() hal_sleep()
+#define sleep_mode() (sleep_enable(), sleep_cpu(), sleep_disable())
+
+// system clock prescaler
+typedef enum {
+    clock_div_1, clock_div_2, clock_div_4, clock_div_8, clock_div_16,
+    clock_div_32, clock_div_64, clock_div_128, clock_div_256
+} clock_div_t;
+#define clock_prescale_set(div) (CLKPR = (div))
+
+#define wdt_reset() ((void)0)
+
+// flash and EEPROM live in ordinary memory
+#define PROGMEM
+#define pgm_read_byte(p) (*(uint8_t const *)(p))
+#define EEMEM __attribute__ ((section ("hal_eeprom")))
+uint8_t eeprom_read_byte(uint8_t const *p);
+
+#define NOINIT __attribute__ ((section ("hal_noinit")))
+
+// hal_host.c provides main() and runs the firmware's main() as fw_main()
+#define main fw_main
+#define OS_MAIN
+
+#endif
@@ -0,0 +1,49 @@
+#!/usr/bin/env python3
+"""Pack the ramp profiles defined in driver.c for ramp_profiles[].
+
+Each profile is stored as its first level, its number of levels, then the
+differences between consecutive levels as nibbles, two per byte with the
+high nibble first. A nibble of 0xF adds 15 and continues with the next
+nibble, so a difference of 15 is stored as 0xF, 0x0.
+
+Usage: ./lut_pack.py [driver.c]
+"""
+import re
+import sys
+
+PROFILES = ["SINUSOID", "LN_SINUSOID", "SQUARED", "SIN_SQUARED_4",
+            "SIN_SQUARED"]
+
+
+def pack(levels):
+    nibbles = []
+    for a, b in zip(levels, levels[1:]):
+        d = b - a
+        if d < 0:
+            raise ValueError("profile must not decrease")
+        while d >= 15:
+            nibbles.append(15)
+            d -= 15
+        nibbles.append(d)
+    if len(nibbles) % 2:
+        nibbles.append(0)
+    data = [levels[0], len(levels)]
+    data += [hi << 4 | lo for hi, lo in zip(nibbles[::2], nibbles[1::2])]
+    return data
+
+
+def main():
+    src = open(sys.argv[1] if len(sys.argv) > 1 else "driver.c").read()
+    offset = 0
+    for name in PROFILES:
+        m = re.search(r"#define %s ([0-9, ]+)\n" % name, src)
+        data = pack([int(v) for v in m.group(1).split(",")])
+        print("#define PACKED_%s %s" % (name, ", ".join(
+            "0x%02X" % b for b in data)))
+        print("#define PROFILE_%s %d" % (name, offset))
+        offset += len(data)
+    print("// %d bytes" % offset)
+
+
+if __name__ == "__main__":
+    main()